@@ -25,8 +25,14 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
 
 #ifdef LXPLUG
 #include "plugin.h"
@@ -47,18 +53,51 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SYSFS_THERMAL_DIRECTORY     "/sys/class/thermal/"
 #define SYSFS_THERMAL_SUBDIR_PREFIX "thermal_zone"
 #define SYSFS_THERMAL_TEMPF         "temp"
+#define SYSFS_COOLING_PREFIX        "cooling_device"
+
+#define PROFILE_ENV                 "CPUTEMP_PROFILE"
+#define RECORD_ENV                  "CPUTEMP_RECORD"
+#define RECORD_TEMP_ENV             "CPUTEMP_RECORD_TEMP"
+
+typedef struct
+{
+    guint64 ticks[TOP_WINDOW];              /* CPU ticks, indexed by sample number */
+    int samples;                            /* Valid entries in ticks */
+    guint seen;                             /* Last sample in which process was found */
+    char comm[16];
+} TopProc;
+
+typedef struct
+{
+    int pid;
+    double rate;                            /* CPU ticks per second over process's window */
+    char comm[16];
+} TopEntry;
+
+struct _CPUTempTop
+{
+    DIR *proc;                              /* Handle on /proc, kept open while hot */
+    GHashTable *procs;                      /* TopProc by pid */
+    gint64 times[TOP_WINDOW];               /* Time of each sample, indexed by sample number */
+    guint sample;
+    TopEntry heap[TOP_NUM];                 /* Min-heap of largest consumers */
+    int nheap;
+    char *text;
+};
 
 /*----------------------------------------------------------------------------*/
 /* Global data                                                                */
 /*----------------------------------------------------------------------------*/
 
-conf_table_t conf_table[7] = {
+conf_table_t conf_table[9] = {
     {CONF_TYPE_COLOUR,   "foreground",   N_("Foreground colour"),               NULL},
     {CONF_TYPE_COLOUR,   "background",   N_("Background colour"),               NULL},
     {CONF_TYPE_COLOUR,   "throttle_1",   N_("Colour when ARM frequency capped"),NULL},
     {CONF_TYPE_COLOUR,   "throttle_2",   N_("Colour when throttled"),           NULL},
     {CONF_TYPE_INT,      "low_temp",     N_("Lower temperature bound"),         NULL},
     {CONF_TYPE_INT,      "high_temp",    N_("Upper temperature bound"),         NULL},
+    {CONF_TYPE_INT,      "top_threshold", N_("Show top processes above (% of upper bound)"), NULL},
+    {CONF_TYPE_INT,      "smoothing",    N_("Temperature smoothing (%)"),       NULL},
     {CONF_TYPE_NONE,     NULL,           NULL,                                  NULL}
 };
 
@@ -68,16 +107,48 @@ conf_table_t conf_table[7] = {
 
 static gint proc_get_temperature (char const *sensor_path);
 static gint _get_reading (const char *path);
+static gint _pread_value (int fd);
 static gint sysfs_get_temperature (char const *sensor_path);
 static gint hwmon_get_temperature (char const *sensor_path);
 static int add_sensor (CPUTempPlugin* c, char const* sensor_path, GetTempFunc get_temp);
-static gboolean try_hwmon_sensors (CPUTempPlugin* c, const char *path);
-static void find_hwmon_sensors (CPUTempPlugin* c);
+static gboolean read_label (const char *path, char *buf, int len);
+static int add_fan (CPUTempPlugin* c, char const* path, char const* label, FanType type, int max, int channel);
+static gboolean try_hwmon_sensors (CPUTempPlugin* c, const char *path, const char *name, gboolean temps);
+static void find_hwmon_sensors (CPUTempPlugin* c, gboolean temps);
+static void find_cooling_devices (CPUTempPlugin* c);
 static void find_sensors (CPUTempPlugin* c, char const* directory, char const* subdir_prefix, GetTempFunc get_temp);
 static void check_sensors (CPUTempPlugin *c);
 static gint get_temperature (CPUTempPlugin *c);
+static void read_fans (CPUTempPlugin *c);
+static void check_fans (CPUTempPlugin *c, gboolean hot);
 static char *get_string (char *cmd);
 static int get_throttle (void);
+static guint64 prof_start (CPUTempPlugin *c);
+static void prof_add (ProfHist *h, guint64 start);
+static void prof_stop (CPUTempPlugin *c, ProfStage stage, guint64 start);
+static const char *sensor_backend (GetTempFunc get_temp);
+static void prof_append (GString *str, const char *prefix, ProfHist *h);
+static gboolean prof_dump (CPUTempPlugin *c);
+static void prof_init (CPUTempPlugin *c);
+static void prof_free (CPUTempPlugin *c);
+static void rec_trigger (CPUTempRecorder *rec, const char *reason);
+static gint rec_compare (gconstpointer a, gconstpointer b);
+static void rec_prune (CPUTempRecorder *rec);
+static gpointer rec_write (gpointer data);
+static void rec_flush (CPUTempRecorder *rec);
+static gboolean rec_sample (CPUTempPlugin *c);
+static void rec_throttle (CPUTempPlugin *c, guint32 throttle);
+static void rec_init (CPUTempPlugin *c);
+static void rec_free (CPUTempPlugin *c);
+static gboolean read_proc_stat (int dirfd, const char *pid, guint64 *ticks, char *comm);
+static void top_push (CPUTempTop *top, int pid, double rate, const char *comm);
+static gboolean top_expired (gpointer key, gpointer value, gpointer user_data);
+static void top_sample (CPUTempPlugin *c);
+static void top_start (CPUTempPlugin *c);
+static void top_stop (CPUTempPlugin *c);
+static void update_tooltip (CPUTempPlugin *c);
+static float filter_temp (CPUTempPlugin *c, int temp);
+static int filter_throttle (CPUTempPlugin *c, int thr);
 static gboolean cpu_update (CPUTempPlugin *c);
 static gboolean write_config (CPUTempPlugin *c);
 static void validate_temps (CPUTempPlugin *c);
@@ -140,6 +211,19 @@ static gint _get_reading (const char *path)
     return -1;
 }
 
+/* Read a value from a handle which is kept open - no allocation */
+
+static gint _pread_value (int fd)
+{
+    char buf[32];
+    ssize_t len;
+
+    len = pread (fd, buf, sizeof (buf) - 1, 0);
+    if (len <= 0) return -1;
+    buf[len] = '\0';
+    return atoi (buf);
+}
+
 static gint sysfs_get_temperature (char const *sensor_path)
 {
     char sstmp [100];
@@ -175,57 +259,149 @@ static int add_sensor (CPUTempPlugin* c, char const* sensor_path, GetTempFunc ge
     return 0;
 }
 
-static gboolean try_hwmon_sensors (CPUTempPlugin* c, const char *path)
+static gboolean read_label (const char *path, char *buf, int len)
+{
+    FILE *fp;
+    char *pp;
+
+    buf[0] = '\0';
+    if (!(fp = fopen (path, "r"))) return FALSE;
+    if (fgets (buf, len, fp))
+    {
+        pp = strchr (buf, '\n');
+        if (pp) *pp = '\0';
+    }
+    fclose (fp);
+    return buf[0] != '\0';
+}
+
+static int add_fan (CPUTempPlugin* c, char const* path, char const* label, FanType type, int max, int channel)
+{
+    int fd;
+
+    if (c->numfans + 1 > MAX_NUM_FANS)
+    {
+        g_message ("cputemp: Too many fans (max %d), ignoring '%s'", MAX_NUM_FANS, path);
+        return -1;
+    }
+
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        g_warning ("cputemp: cannot open %s", path);
+        return -1;
+    }
+
+    c->fans[c->numfans].type = type;
+    c->fans[c->numfans].fd = fd;
+    c->fans[c->numfans].max = max;
+    c->fans[c->numfans].channel = channel;
+    c->fans[c->numfans].pwm = -1;
+    c->fans[c->numfans].spun = FALSE;
+    c->fans[c->numfans].value = -1;
+    c->fans[c->numfans].label = g_strdup (label);
+    c->numfans++;
+
+    g_message ("cputemp: Added fan %s", path);
+
+    return 0;
+}
+
+static gboolean try_hwmon_sensors (CPUTempPlugin* c, const char *path, const char *name, gboolean temps)
 {
     GDir *sensorsDirectory;
     const char *sensor_name;
     char sensor_path[100], buf[256];
-    FILE *fp;
     gboolean found = FALSE;
+    int first = c->numfans, i, j;
 
     if (!(sensorsDirectory = g_dir_open (path, 0, NULL))) return found;
 
+    /* Only temperatures count as found - fans alone don't stop the parent being scanned */
+
     while ((sensor_name = g_dir_read_name (sensorsDirectory)))
     {
-        if (strncmp (sensor_name, "temp", 4) == 0 &&
+        if (temps && strncmp (sensor_name, "temp", 4) == 0 &&
             strcmp (&sensor_name[5], "_input") == 0)
         {
-            snprintf (sensor_path, sizeof (sensor_path), "%s/temp%c_label", path, sensor_name[4]);
-            fp = fopen (sensor_path, "r");
-            buf[0] = '\0';
-            if (fp)
-            {
-                if (fgets (buf, 256, fp))
-                {
-                    char *pp = strchr (buf, '\n');
-                    if (pp) *pp = '\0';
-                }
-                fclose (fp);
-            }
             snprintf (sensor_path, sizeof (sensor_path), "%s/%s", path, sensor_name);
             add_sensor (c, sensor_path, hwmon_get_temperature);
             found = TRUE;
         }
+        else if (strncmp (sensor_name, "fan", 3) == 0 && g_str_has_suffix (sensor_name, "_input"))
+        {
+            snprintf (sensor_path, sizeof (sensor_path), "%s/%s", path, sensor_name);
+            snprintf (buf, sizeof (buf), "%s %.*s", name, (int) strlen (sensor_name) - 6, sensor_name);
+            add_fan (c, sensor_path, buf, FAN_RPM, 0, atoi (&sensor_name[3]));
+        }
+        else if (strncmp (sensor_name, "pwm", 3) == 0 && sensor_name[3] &&
+            strspn (&sensor_name[3], "0123456789") == strlen (&sensor_name[3]))
+        {
+            snprintf (sensor_path, sizeof (sensor_path), "%s/%s", path, sensor_name);
+            snprintf (buf, sizeof (buf), "%s %s", name, sensor_name);
+            add_fan (c, sensor_path, buf, FAN_PWM, 255, atoi (&sensor_name[3]));
+        }
     }
     g_dir_close (sensorsDirectory);
+
+    /* Pair each fan with the pwm which drives it in the same directory */
+    for (i = first; i < c->numfans; i++)
+    {
+        if (c->fans[i].type != FAN_RPM) continue;
+        for (j = first; j < c->numfans; j++)
+            if (c->fans[j].type == FAN_PWM && c->fans[j].channel == c->fans[i].channel) c->fans[i].pwm = j;
+
+        /* A pwm which exists but didn't fit can't be checked, so don't guess */
+        if (c->fans[i].pwm < 0)
+        {
+            snprintf (sensor_path, sizeof (sensor_path), "%s/pwm%d", path, c->fans[i].channel);
+            if (access (sensor_path, R_OK) == 0) c->fans[i].pwm = FAN_PWM_UNKNOWN;
+        }
+    }
     return found;
 }
 
-static void find_hwmon_sensors (CPUTempPlugin* c)
+static void find_hwmon_sensors (CPUTempPlugin* c, gboolean temps)
 {
-    char dir_path[100];
+    char dir_path[100], name[64];
     char *cptr;
     int i; /* sensor type num, we'll try up to 4 */
 
     for (i = 0; i < 4; i++)
     {
+        snprintf (dir_path, sizeof (dir_path), "/sys/class/hwmon/hwmon%d/name", i);
+        if (!read_label (dir_path, name, sizeof (name))) snprintf (name, sizeof (name), "hwmon%d", i);
+
         snprintf (dir_path, sizeof (dir_path), "/sys/class/hwmon/hwmon%d/device", i);
-        if (try_hwmon_sensors (c, dir_path)) continue;
+        if (try_hwmon_sensors (c, dir_path, name, temps)) continue;
         /* no sensors found under device/, try parent dir */
         cptr = strrchr (dir_path, '/');
         *cptr = '\0';
-        try_hwmon_sensors (c, dir_path);
+        try_hwmon_sensors (c, dir_path, name, temps);
+    }
+}
+
+static void find_cooling_devices (CPUTempPlugin* c)
+{
+    GDir *coolingDirectory;
+    const char *dev_name;
+    char path[100], label[64], buf[16];
+    int max;
+
+    if (!(coolingDirectory = g_dir_open (SYSFS_THERMAL_DIRECTORY, 0, NULL))) return;
+
+    while ((dev_name = g_dir_read_name (coolingDirectory)))
+    {
+        if (strncmp (dev_name, SYSFS_COOLING_PREFIX, strlen (SYSFS_COOLING_PREFIX)) != 0) continue;
+
+        /* Only fans - not cpufreq, devfreq or processor cooling devices */
+        snprintf (path, sizeof (path), "%s%s/type", SYSFS_THERMAL_DIRECTORY, dev_name);
+        if (!read_label (path, label, sizeof (label)) || !strcasestr (label, "fan")) continue;
+        snprintf (path, sizeof (path), "%s%s/max_state", SYSFS_THERMAL_DIRECTORY, dev_name);
+        max = read_label (path, buf, sizeof (buf)) ? atoi (buf) : 0;
+        snprintf (path, sizeof (path), "%s%s/cur_state", SYSFS_THERMAL_DIRECTORY, dev_name);
+        add_fan (c, path, label, FAN_COOLING, max, atoi (&dev_name[strlen (SYSFS_COOLING_PREFIX)]));
     }
+    g_dir_close (coolingDirectory);
 }
 
 static void find_sensors (CPUTempPlugin* c, char const* directory, char const* subdir_prefix, GetTempFunc get_temp)
@@ -256,21 +432,33 @@ static void check_sensors (CPUTempPlugin *c)
 
     for (i = 0; i < c->numsensors; i++) g_free (c->sensor_array[i]);
     c->numsensors = 0;
+    for (i = 0; i < c->numfans; i++)
+    {
+        close (c->fans[i].fd);
+        g_free (c->fans[i].label);
+    }
+    c->numfans = 0;
 
     find_sensors (c, PROC_THERMAL_DIRECTORY, NULL, proc_get_temperature);
     find_sensors (c, SYSFS_THERMAL_DIRECTORY, SYSFS_THERMAL_SUBDIR_PREFIX, sysfs_get_temperature);
-    if (c->numsensors == 0) find_hwmon_sensors (c);
+
+    /* Always scan hwmon for fans, but only use its temperatures as a fallback */
+    find_hwmon_sensors (c, c->numsensors == 0);
+    find_cooling_devices (c);
     
-    g_message ("cputemp: Found %d sensors", c->numsensors);
+    g_message ("cputemp: Found %d sensors, %d fans", c->numsensors, c->numfans);
 }
 
 static gint get_temperature (CPUTempPlugin *c)
 {
     gint max = -273, cur, i;
+    guint64 t;
 
     for (i = 0; i < c->numsensors; i++)
     {
+        t = prof_start (c);
         cur = c->get_temperature[i] (c->sensor_array[i]);
+        if (c->prof) prof_add (&c->prof->sensor[i], t);
         if (cur > max) max = cur;
         c->temperature[i] = cur;
     }
@@ -278,6 +466,33 @@ static gint get_temperature (CPUTempPlugin *c)
     return max;
 }
 
+static void read_fans (CPUTempPlugin *c)
+{
+    int i;
+
+    for (i = 0; i < c->numfans; i++) c->fans[i].value = _pread_value (c->fans[i].fd);
+}
+
+/* A fan is stalled if it has been seen spinning, but reads 0 RPM while hot and its pwm is driving it */
+
+static void check_fans (CPUTempPlugin *c, gboolean hot)
+{
+    FanSensor *fan;
+    gboolean stalled = FALSE;
+    int i;
+
+    for (i = 0; i < c->numfans; i++)
+    {
+        fan = &c->fans[i];
+        if (fan->type != FAN_RPM || fan->pwm == FAN_PWM_UNKNOWN) continue;
+        if (fan->value > 0) fan->spun = TRUE;
+        if (hot && fan->spun && fan->value == 0 && (fan->pwm < 0 || c->fans[fan->pwm].value > 0)) stalled = TRUE;
+    }
+
+    if (stalled && !c->fan_stalled) g_warning ("cputemp: fan stalled while hot");
+    c->fan_stalled = stalled;
+}
+
 static char *get_string (char *cmd)
 {
     char *line = NULL, *res = NULL;
@@ -312,37 +527,694 @@ static int get_throttle (void)
     return val;
 }
 
+/* Profiling of the update tick - enabled by setting CPUTEMP_PROFILE at load */
+
+static guint64 prof_start (CPUTempPlugin *c)
+{
+    struct timespec ts;
+
+    if (!c->prof) return 0;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void prof_add (ProfHist *h, guint64 start)
+{
+    struct timespec ts;
+    guint64 ns, v;
+    int b = 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec - start;
+
+    for (v = ns; v && b < PROF_BUCKETS - 1; v >>= 1) b++;
+    h->bucket[b]++;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static void prof_stop (CPUTempPlugin *c, ProfStage stage, guint64 start)
+{
+    if (c->prof) prof_add (&c->prof->stage[stage], start);
+}
+
+static const char *sensor_backend (GetTempFunc get_temp)
+{
+    if (get_temp == proc_get_temperature) return "proc";
+    if (get_temp == sysfs_get_temperature) return "sysfs";
+    if (get_temp == hwmon_get_temperature) return "hwmon";
+    return "unknown";
+}
+
+static void prof_append (GString *str, const char *prefix, ProfHist *h)
+{
+    int b;
+
+    g_string_append_printf (str, "%s count %" G_GUINT64_FORMAT " total_ns %" G_GUINT64_FORMAT
+        " max_ns %" G_GUINT64_FORMAT " buckets", prefix, h->count, h->total_ns, h->max_ns);
+    for (b = 0; b < PROF_BUCKETS; b++) g_string_append_printf (str, " %u", h->bucket[b]);
+    g_string_append_c (str, '\n');
+}
+
+/* Dump in a stable line-based format - one histogram per line */
+
+static gboolean prof_dump (CPUTempPlugin *c)
+{
+    static const char *stage_names[PROF_NUM_STAGES] = { "tick", "sensors", "throttle", "label", "validate", "graph", "fans" };
+    static const char *backends[] = { "proc", "sysfs", "hwmon" };
+    GString *str;
+    ProfHist total;
+    char *prefix, **lines;
+    int i, j, b;
+
+    str = g_string_new (NULL);
+    g_string_append_printf (str, "cputemp-profile 1 instance %d\n", c->prof->instance);
+
+    for (i = 0; i < PROF_NUM_STAGES; i++)
+    {
+        prefix = g_strdup_printf ("stage %s", stage_names[i]);
+        prof_append (str, prefix, &c->prof->stage[i]);
+        g_free (prefix);
+    }
+
+    for (i = 0; i < (int) G_N_ELEMENTS (backends); i++)
+    {
+        memset (&total, 0, sizeof (ProfHist));
+        for (j = 0; j < c->numsensors; j++)
+        {
+            if (strcmp (sensor_backend (c->get_temperature[j]), backends[i])) continue;
+            total.count += c->prof->sensor[j].count;
+            total.total_ns += c->prof->sensor[j].total_ns;
+            if (c->prof->sensor[j].max_ns > total.max_ns) total.max_ns = c->prof->sensor[j].max_ns;
+            for (b = 0; b < PROF_BUCKETS; b++) total.bucket[b] += c->prof->sensor[j].bucket[b];
+        }
+        prefix = g_strdup_printf ("backend %s", backends[i]);
+        prof_append (str, prefix, &total);
+        g_free (prefix);
+    }
+
+    for (i = 0; i < c->numsensors; i++)
+    {
+        prefix = g_strdup_printf ("sensor %d %s %s", i, sensor_backend (c->get_temperature[i]), c->sensor_array[i]);
+        prof_append (str, prefix, &c->prof->sensor[i]);
+        g_free (prefix);
+    }
+
+    if (c->prof->dump_path)
+    {
+        if (!g_file_set_contents (c->prof->dump_path, str->str, str->len, NULL))
+            g_warning ("cputemp: cannot write profile to %s", c->prof->dump_path);
+    }
+    else
+    {
+        lines = g_strsplit (str->str, "\n", -1);
+        for (i = 0; lines[i]; i++) if (*lines[i]) g_message ("cputemp %d: %s", c->prof->instance, lines[i]);
+        g_strfreev (lines);
+    }
+
+    g_string_free (str, TRUE);
+    return TRUE;
+}
+
+static void prof_init (CPUTempPlugin *c)
+{
+    static int instances = 0;
+    const char *env = g_getenv (PROFILE_ENV);
+
+    if (!env || !*env) return;
+
+    /* Every instance gets its own dump file, as all of them see the signal */
+    c->prof = g_new0 (CPUTempProfile, 1);
+    c->prof->instance = instances++;
+    if (g_path_is_absolute (env)) c->prof->dump_path = g_strdup_printf ("%s.%d", env, c->prof->instance);
+    c->prof->signal = g_unix_signal_add (SIGUSR2, (GSourceFunc) prof_dump, (gpointer) c);
+
+    g_message ("cputemp: Profiling enabled - send SIGUSR2 to dump to %s",
+        c->prof->dump_path ? c->prof->dump_path : "journal");
+}
+
+static void prof_free (CPUTempPlugin *c)
+{
+    if (!c->prof) return;
+
+    if (c->prof->signal) g_source_remove (c->prof->signal);
+    prof_dump (c);
+    g_free (c->prof->dump_path);
+    g_free (c->prof);
+    c->prof = NULL;
+}
+
+/* Flight recorder - enabled by setting CPUTEMP_RECORD to a directory at load */
+
+static void rec_trigger (CPUTempRecorder *rec, const char *reason)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    /* Ignore triggers during a window, while the last one is written, or too soon after it */
+    if (rec->post || g_atomic_int_get (&rec->busy)) return;
+    if (rec->trigger_time && now - rec->trigger_time < REC_MIN_GAP * G_USEC_PER_SEC) return;
+
+    rec->post = REC_POST_SAMPLES;
+    rec->trigger_time = now;
+    rec->reason = reason;
+}
+
+static gint rec_compare (gconstpointer a, gconstpointer b)
+{
+    gint64 ta = g_ascii_strtoll (strrchr (*((char **) a), '-') + 1, NULL, 10);
+    gint64 tb = g_ascii_strtoll (strrchr (*((char **) b), '-') + 1, NULL, 10);
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Delete this instance's oldest recordings so at most REC_MAX_FILES are kept */
+
+static void rec_prune (CPUTempRecorder *rec)
+{
+    GDir *recDirectory;
+    GPtrArray *files;
+    const char *name;
+    char *path, *prefix;
+    guint i;
+
+    if (!(recDirectory = g_dir_open (rec->dir, 0, NULL))) return;
+
+    prefix = g_strdup_printf ("cputemp-%d-", rec->instance);
+    files = g_ptr_array_new_with_free_func (g_free);
+    while ((name = g_dir_read_name (recDirectory)))
+    {
+        if (g_str_has_prefix (name, prefix) && g_str_has_suffix (name, ".csv"))
+            g_ptr_array_add (files, g_strdup (name));
+    }
+    g_dir_close (recDirectory);
+    g_free (prefix);
+
+    g_ptr_array_sort (files, rec_compare);
+    for (i = 0; i + REC_MAX_FILES < files->len; i++)
+    {
+        path = g_build_filename (rec->dir, g_ptr_array_index (files, i), NULL);
+        if (unlink (path)) g_warning ("cputemp: cannot delete %s", path);
+        g_free (path);
+    }
+    g_ptr_array_free (files, TRUE);
+}
+
+static gpointer rec_write (gpointer data)
+{
+    CPUTempRecorder *rec = (CPUTempRecorder *) data;
+    char *path;
+    FILE *fp;
+    int i;
+
+    path = g_strdup_printf ("%s/cputemp-%d-%" G_GINT64_FORMAT ".csv", rec->dir, rec->instance,
+        g_get_real_time () / G_USEC_PER_SEC);
+    if ((fp = fopen (path, "w")))
+    {
+        fprintf (fp, "# cputemp flight recorder, trigger %s\n", rec->dump_reason);
+        fprintf (fp, "time_ms,temp_mC,throttle\n");
+        for (i = 0; i < rec->dump_len; i++)
+            fprintf (fp, "%" G_GINT64_FORMAT ",%d,0x%x\n", (rec->dump[i].time - rec->dump_trigger) / 1000,
+                rec->dump[i].mtemp, rec->dump[i].throttle);
+        fclose (fp);
+        g_message ("cputemp: Recorded %s event to %s", rec->dump_reason, path);
+    }
+    else g_warning ("cputemp: cannot open %s", path);
+
+    g_free (path);
+    rec_prune (rec);
+    g_atomic_int_set (&rec->busy, 0);
+    return NULL;
+}
+
+static void rec_flush (CPUTempRecorder *rec)
+{
+    int i, slot;
+
+    /* Any previous writer has finished, as busy is clear */
+    if (rec->writer) g_thread_join (rec->writer);
+
+    slot = (rec->head - rec->filled + REC_SAMPLES) % REC_SAMPLES;
+    for (i = 0; i < rec->filled; i++)
+    {
+        rec->dump[i] = rec->ring[slot];
+        slot = (slot + 1) % REC_SAMPLES;
+    }
+    rec->dump_len = rec->filled;
+    rec->dump_trigger = rec->trigger_time;
+    rec->dump_reason = rec->reason;
+
+    g_atomic_int_set (&rec->busy, 1);
+    rec->writer = g_thread_new ("cputemp-rec", rec_write, rec);
+}
+
+/* High rate timer callback */
+
+static gboolean rec_sample (CPUTempPlugin *c)
+{
+    CPUTempRecorder *rec = c->rec;
+    RecSample *s;
+    int trigger;
+
+    if (g_source_is_destroyed (g_main_current_source ())) return FALSE;
+
+    s = &rec->ring[rec->head];
+    s->time = g_get_monotonic_time ();
+    s->mtemp = _pread_value (rec->fd);
+    s->throttle = rec->throttle;
+
+    rec->head = (rec->head + 1) % REC_SAMPLES;
+    if (rec->filled < REC_SAMPLES) rec->filled++;
+
+    /* Trigger on rising to the threshold, or on falling REC_REARM degrees below it */
+    trigger = (rec->trigger_temp ? rec->trigger_temp : c->upper_temp) * 1000;
+    if (rec->filled == 1) rec->above = s->mtemp >= trigger;
+    else if (!rec->above && s->mtemp >= trigger)
+    {
+        rec->above = TRUE;
+        rec_trigger (rec, "temperature");
+    }
+    else if (rec->above && s->mtemp < trigger - REC_REARM * 1000)
+    {
+        rec->above = FALSE;
+        rec_trigger (rec, "temperature");
+    }
+
+    if (rec->post && --rec->post == 0) rec_flush (rec);
+
+    return TRUE;
+}
+
+/* Called from the main update with the throttle flags from vcgencmd */
+
+static void rec_throttle (CPUTempPlugin *c, guint32 throttle)
+{
+    CPUTempRecorder *rec = c->rec;
+
+    /* Only the current state bits - the upper bits are sticky */
+    if (rec->have_throttle && (throttle & 0xF) != (rec->throttle & 0xF)) rec_trigger (rec, "throttle");
+    rec->throttle = throttle;
+    rec->have_throttle = TRUE;
+}
+
+static void rec_init (CPUTempPlugin *c)
+{
+    static int instances = 0;
+    const char *env = g_getenv (RECORD_ENV);
+    char *path = NULL;
+    int i, fd = -1;
+
+    if (!env || !*env) return;
+
+    if (!g_path_is_absolute (env))
+    {
+        g_warning ("cputemp: %s must be an absolute directory", RECORD_ENV);
+        return;
+    }
+
+    /* Sample the first sensor which can be read directly through a kept-open handle */
+    for (i = 0; i < c->numsensors && fd < 0; i++)
+    {
+        if (c->get_temperature[i] == sysfs_get_temperature)
+            path = g_strdup_printf ("%s%s", c->sensor_array[i], SYSFS_THERMAL_TEMPF);
+        else if (c->get_temperature[i] == hwmon_get_temperature)
+            path = g_strdup (c->sensor_array[i]);
+        else continue;
+
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) g_message ("cputemp: Recording %s every %dms to %s", path, REC_INTERVAL, env);
+        g_free (path);
+    }
+
+    if (fd < 0)
+    {
+        g_warning ("cputemp: no sensor suitable for recording");
+        return;
+    }
+
+    c->rec = g_new0 (CPUTempRecorder, 1);
+    c->rec->dir = g_strdup (env);
+    /* Every instance shares the directory, so file names carry the instance number */
+    c->rec->instance = instances++;
+    c->rec->fd = fd;
+    env = g_getenv (RECORD_TEMP_ENV);
+    if (env) c->rec->trigger_temp = atoi (env);
+    c->rec->timer = g_timeout_add (REC_INTERVAL, (GSourceFunc) rec_sample, (gpointer) c);
+}
+
+static void rec_free (CPUTempPlugin *c)
+{
+    if (!c->rec) return;
+
+    if (c->rec->timer) g_source_remove (c->rec->timer);
+    if (c->rec->writer) g_thread_join (c->rec->writer);
+    close (c->rec->fd);
+    g_free (c->rec->dir);
+    g_free (c->rec);
+    c->rec = NULL;
+}
+
+/* Top process sampling - only runs while hot or throttled */
+
+/* Only /proc is kept open, with each <pid>/stat opened relative to it. Keeping a
+ * handle per process would hold hundreds of descriptors in the panel process while
+ * hot, for little gain over one openat() per process per 1.5s tick. */
+
+static gboolean read_proc_stat (int dirfd, const char *pid, guint64 *ticks, char *comm)
+{
+    char path[32], buf[512], *start, *end;
+    unsigned long long utime, stime;
+    ssize_t len;
+    int fd;
+
+    snprintf (path, sizeof (path), "%s/stat", pid);
+    if ((fd = openat (dirfd, path, O_RDONLY | O_CLOEXEC)) < 0) return FALSE;
+    len = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (len <= 0) return FALSE;
+    buf[len] = '\0';
+
+    /* Command name is in brackets and may itself contain spaces or brackets */
+    if (!(start = strchr (buf, '(')) || !(end = strrchr (buf, ')'))) return FALSE;
+    if (end + 2 >= buf + len) return FALSE;
+    if (sscanf (end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return FALSE;
+
+    *end = '\0';
+    g_strlcpy (comm, start + 1, 16);
+    *ticks = utime + stime;
+    return TRUE;
+}
+
+static void top_push (CPUTempTop *top, int pid, double rate, const char *comm)
+{
+    TopEntry tmp;
+    int i, child;
+
+    if (top->nheap == TOP_NUM)
+    {
+        if (rate <= top->heap[0].rate) return;
+
+        /* Replace the smallest and sift down */
+        i = 0;
+        top->heap[0].pid = pid;
+        top->heap[0].rate = rate;
+        strcpy (top->heap[0].comm, comm);
+        while ((child = 2 * i + 1) < top->nheap)
+        {
+            if (child + 1 < top->nheap && top->heap[child + 1].rate < top->heap[child].rate) child++;
+            if (top->heap[i].rate <= top->heap[child].rate) break;
+            tmp = top->heap[i];
+            top->heap[i] = top->heap[child];
+            top->heap[child] = tmp;
+            i = child;
+        }
+        return;
+    }
+
+    /* Append and sift up */
+    i = top->nheap++;
+    top->heap[i].pid = pid;
+    top->heap[i].rate = rate;
+    strcpy (top->heap[i].comm, comm);
+    while (i > 0 && top->heap[(i - 1) / 2].rate > top->heap[i].rate)
+    {
+        tmp = top->heap[i];
+        top->heap[i] = top->heap[(i - 1) / 2];
+        top->heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+static gboolean top_expired (gpointer, gpointer value, gpointer user_data)
+{
+    return ((TopProc *) value)->seen != *((guint *) user_data);
+}
+
+static void top_sample (CPUTempPlugin *c)
+{
+    CPUTempTop *top = c->top;
+    struct dirent *de;
+    TopProc *proc;
+    TopEntry tmp;
+    GString *str;
+    guint64 ticks;
+    char comm[16];
+    int pid, slot, oldest, i, j;
+    double secs;
+
+    top->sample++;
+    slot = top->sample % TOP_WINDOW;
+    top->times[slot] = g_get_monotonic_time ();
+    top->nheap = 0;
+
+    rewinddir (top->proc);
+    while ((de = readdir (top->proc)))
+    {
+        if (!g_ascii_isdigit (de->d_name[0])) continue;
+        if (!read_proc_stat (dirfd (top->proc), de->d_name, &ticks, comm)) continue;
+
+        pid = atoi (de->d_name);
+        if (!(proc = g_hash_table_lookup (top->procs, GINT_TO_POINTER (pid))))
+        {
+            proc = g_new0 (TopProc, 1);
+            g_hash_table_insert (top->procs, GINT_TO_POINTER (pid), proc);
+        }
+
+        proc->ticks[slot] = ticks;
+        if (proc->samples < TOP_WINDOW) proc->samples++;
+        proc->seen = top->sample;
+        strcpy (proc->comm, comm);
+
+        /* Measure each process over the samples it has been seen in */
+        if (proc->samples < 2) continue;
+        oldest = (top->sample - proc->samples + 1) % TOP_WINDOW;
+        secs = (top->times[slot] - top->times[oldest]) / (double) G_USEC_PER_SEC;
+        if (ticks > proc->ticks[oldest] && secs > 0)
+            top_push (top, pid, (ticks - proc->ticks[oldest]) / secs, comm);
+    }
+
+    /* Forget processes which have exited */
+    g_hash_table_foreach_remove (top->procs, top_expired, &top->sample);
+
+    /* Sort the heap by descending usage for display */
+    for (i = 1; i < top->nheap; i++)
+    {
+        tmp = top->heap[i];
+        for (j = i; j > 0 && top->heap[j - 1].rate < tmp.rate; j--) top->heap[j] = top->heap[j - 1];
+        top->heap[j] = tmp;
+    }
+
+    g_free (top->text);
+    top->text = NULL;
+    if (top->sample < 2) return;
+
+    oldest = (top->sample - MIN (top->sample, TOP_WINDOW) + 1) % TOP_WINDOW;
+    secs = (top->times[slot] - top->times[oldest]) / (double) G_USEC_PER_SEC;
+    str = g_string_new (NULL);
+    g_string_append_printf (str, _("Top processes (last %.0f s):"), secs);
+    for (i = 0; i < top->nheap; i++)
+        g_string_append_printf (str, "\n%5.1f%%  %s", top->heap[i].rate * 100.0 / sysconf (_SC_CLK_TCK),
+            top->heap[i].comm);
+    top->text = g_string_free (str, FALSE);
+}
+
+static void top_start (CPUTempPlugin *c)
+{
+    DIR *proc;
+
+    if (!(proc = opendir ("/proc")))
+    {
+        g_warning ("cputemp: cannot open /proc");
+        return;
+    }
+
+    c->top = g_new0 (CPUTempTop, 1);
+    c->top->proc = proc;
+    c->top->procs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+}
+
+static void top_stop (CPUTempPlugin *c)
+{
+    if (!c->top) return;
+
+    closedir (c->top->proc);
+    g_hash_table_destroy (c->top->procs);
+    g_free (c->top->text);
+    g_free (c->top);
+    c->top = NULL;
+}
+
+/* Only touch the widget when the text actually changes */
+
+static void update_tooltip (CPUTempPlugin *c)
+{
+    GString *str;
+    FanSensor *fan;
+    char *text;
+    int i;
+
+    str = g_string_new (NULL);
+    if (c->fan_stalled) g_string_append (str, _("Fan stalled while hot!"));
+    for (i = 0; i < c->numfans; i++)
+    {
+        fan = &c->fans[i];
+        if (fan->value < 0) continue;
+        if (str->len) g_string_append_c (str, '\n');
+        switch (fan->type)
+        {
+            case FAN_RPM :      g_string_append_printf (str, _("%s: %d RPM"), fan->label, fan->value);
+                                break;
+            case FAN_PWM :      g_string_append_printf (str, "%s: %d%%", fan->label, fan->value * 100 / fan->max);
+                                break;
+            case FAN_COOLING :  g_string_append_printf (str, "%s: %d/%d", fan->label, fan->value, fan->max);
+                                break;
+        }
+    }
+    if (c->top && c->top->text)
+    {
+        if (str->len) g_string_append_c (str, '\n');
+        g_string_append (str, c->top->text);
+    }
+    text = g_string_free (str, FALSE);
+
+    if (!g_strcmp0 (text, c->tooltip ? c->tooltip : ""))
+    {
+        g_free (text);
+        return;
+    }
+
+    g_free (c->tooltip);
+    c->tooltip = text;
+    gtk_widget_set_tooltip_text (c->plugin, *text ? text : NULL);
+}
+
+/* Noise filtering - median of 3 to reject spikes, then exponential smoothing */
+
+static float filter_temp (CPUTempPlugin *c, int temp)
+{
+    int a, b, d;
+
+    c->raw[c->raw_idx] = temp;
+    c->raw_idx = (c->raw_idx + 1) % 3;
+    if (c->nraw < 3) c->nraw++;
+
+    if (!c->smoothing)
+    {
+        c->filtered = temp;
+        return c->filtered;
+    }
+
+    if (c->nraw == 3)
+    {
+        a = c->raw[0];
+        b = c->raw[1];
+        d = c->raw[2];
+        temp = MAX (MIN (a, b), MIN (MAX (a, b), d));
+    }
+
+    if (c->nraw == 1) c->filtered = temp;
+    else c->filtered += (1.0 - c->smoothing / 100.0) * (temp - c->filtered);
+    return c->filtered;
+}
+
+/* Show a higher throttle state at once, but only drop back once it has settled */
+
+static int filter_throttle (CPUTempPlugin *c, int thr)
+{
+    if (!c->smoothing || thr >= c->shown_thr)
+    {
+        c->shown_thr = thr;
+        c->thr_hold = 0;
+        return c->shown_thr;
+    }
+
+    /* Restart the count whenever the lower state changes */
+    if (!c->thr_hold || thr != c->thr_pending)
+    {
+        c->thr_pending = thr;
+        c->thr_hold = 0;
+    }
+    if (++c->thr_hold >= THROTTLE_HOLD)
+    {
+        c->shown_thr = thr;
+        c->thr_hold = 0;
+    }
+    return c->shown_thr;
+}
+
 /* Periodic timer callback */
 
 static gboolean cpu_update (CPUTempPlugin *c)
 {
-    char *buffer;
-    int temp, thr;
-    float ftemp;
+    int temp, thr, hot, shown;
+    float ftemp, smooth;
+    guint64 t_tick, t;
 
     if (g_source_is_destroyed (g_main_current_source ())) return FALSE;
 
-    temp = get_temperature (c);
+    t_tick = prof_start (c);
 
-    buffer = g_strdup_printf ("%3d°", temp);
+    t = prof_start (c);
+    temp = get_temperature (c);
+    prof_stop (c, PROF_SENSORS, t);
 
+    t = prof_start (c);
     validate_temps (c);
+    prof_stop (c, PROF_VALIDATE, t);
+
+    hot = temp >= c->upper_temp || (c->top_threshold && temp * 100 >= c->upper_temp * c->top_threshold);
+
+    t = prof_start (c);
+    read_fans (c);
+    prof_stop (c, PROF_FANS, t);
+    /* Fan stall alert is independent of the top process threshold */
+    check_fans (c, temp >= c->upper_temp);
+
+    /* Only move the label once the smoothed value is a whole degree away */
+    smooth = filter_temp (c, temp);
+    shown = (int) (smooth + (smooth < 0 ? -0.5 : 0.5));
+    if (!c->label || c->fan_stalled != c->shown_stall
+        || (shown != c->shown_temp && (!c->smoothing || ABS (smooth - c->shown_temp) >= 1.0)))
+    {
+        t = prof_start (c);
+        g_free (c->label);
+        c->label = g_strdup_printf (c->fan_stalled ? "%3d°!" : "%3d°", shown);
+        c->shown_temp = shown;
+        c->shown_stall = c->fan_stalled;
+        prof_stop (c, PROF_LABEL, t);
+    }
 
-    ftemp = temp;
+    ftemp = smooth;
     ftemp -= c->lower_temp;
     ftemp /= (c->upper_temp - c->lower_temp);
 
     thr = 0;
     if (c->ispi)
     {
+        t = prof_start (c);
         temp = get_throttle ();
+        prof_stop (c, PROF_THROTTLE, t);
+        if (c->rec) rec_throttle (c, temp);
         if (temp & 0x08) thr = 2;
         else if (temp & 0x02) thr = 1;
     }
 
-    graph_new_point (&(c->graph), ftemp, thr, buffer);
+    if (c->top_threshold && (hot || thr))
+    {
+        if (!c->top) top_start (c);
+        if (c->top) top_sample (c);
+    }
+    else top_stop (c);
+    update_tooltip (c);
+
+    thr = filter_throttle (c, thr);
 
-    g_free (buffer);
+    t = prof_start (c);
+    graph_new_point (&(c->graph), ftemp, thr, c->label);
+    prof_stop (c, PROF_GRAPH, t);
+
+    prof_stop (c, PROF_TICK, t_tick);
     return TRUE;
 }
 
@@ -361,6 +1233,8 @@ static gboolean write_config (CPUTempPlugin *c)
 
     g_key_file_set_integer (kf, "panel", "cputemp_low_temp", c->lower_temp);
     g_key_file_set_integer (kf, "panel", "cputemp_high_temp", c->upper_temp);
+    g_key_file_set_integer (kf, "panel", "cputemp_top_threshold", c->top_threshold);
+    g_key_file_set_integer (kf, "panel", "cputemp_smoothing", c->smoothing);
 
     strval = g_key_file_to_data (kf, &len, NULL);
     g_file_set_contents (user_file, strval, len, NULL);
@@ -375,10 +1249,12 @@ static gboolean write_config (CPUTempPlugin *c)
 
 static void validate_temps (CPUTempPlugin *c)
 {
-    int lower, upper;
+    int lower, upper, top, smoothing;
 
     lower = c->lower_temp;
     upper = c->upper_temp;
+    top = c->top_threshold;
+    smoothing = c->smoothing;
 
     if (c->lower_temp < 0 || c->lower_temp > 100) c->lower_temp = 40;
     if (c->upper_temp < 0 || c->upper_temp > 150) c->upper_temp = 90;
@@ -387,8 +1263,11 @@ static void validate_temps (CPUTempPlugin *c)
         c->lower_temp = 40;
         c->upper_temp = 90;
     }
+    if (c->top_threshold < 0 || c->top_threshold > 100) c->top_threshold = 90;
+    if (c->smoothing < 0 || c->smoothing > 90) c->smoothing = 0;
 
-    if (lower != c->lower_temp || upper != c->upper_temp) g_idle_add ((GSourceFunc) write_config, (gpointer) c);
+    if (lower != c->lower_temp || upper != c->upper_temp || top != c->top_threshold || smoothing != c->smoothing)
+        g_idle_add ((GSourceFunc) write_config, (gpointer) c);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -419,6 +1298,10 @@ void cputemp_init (CPUTempPlugin *c)
     /* Find the system thermal sensors */
     check_sensors (c);
 
+    /* Optional timing of the update tick and high rate recording */
+    prof_init (c);
+    rec_init (c);
+
     /* Constrain temperatures */
     validate_temps (c);
 
@@ -434,9 +1317,21 @@ void cputemp_init (CPUTempPlugin *c)
 void cputemp_destructor (gpointer user_data)
 {
     CPUTempPlugin *c = (CPUTempPlugin *) user_data;
+    int i;
 
     graph_free (&(c->graph));
     if (c->timer) g_source_remove (c->timer);
+    prof_free (c);
+    rec_free (c);
+    top_stop (c);
+    g_free (c->tooltip);
+    g_free (c->label);
+    for (i = 0; i < c->numsensors; i++) g_free (c->sensor_array[i]);
+    for (i = 0; i < c->numfans; i++)
+    {
+        close (c->fans[i].fd);
+        g_free (c->fans[i].label);
+    }
 
     g_free (c);
 }
@@ -465,6 +1360,7 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
     gdk_rgba_parse (&c->high_throttle_colour, "red");
     c->lower_temp = 40;
     c->upper_temp = 90;
+    c->top_threshold = 90;
 
     /* Read config */
     conf_table[0].value = (void *) &c->foreground_colour;
@@ -473,6 +1369,8 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
     conf_table[3].value = (void *) &c->high_throttle_colour;
     conf_table[4].value = (void *) &c->lower_temp;
     conf_table[5].value = (void *) &c->upper_temp;
+    conf_table[6].value = (void *) &c->top_threshold;
+    conf_table[7].value = (void *) &c->smoothing;
     lxplug_read_settings (c->settings, conf_table);
 
     cputemp_init (c);
@@ -57,6 +57,8 @@ void WayfireCPUTemp::read_settings (void)
 
     cput->lower_temp = low_temp;
     cput->upper_temp = high_temp;
+    cput->top_threshold = top_threshold;
+    cput->smoothing = smoothing;
 }
 
 void WayfireCPUTemp::settings_changed_cb (void)
@@ -91,6 +93,8 @@ void WayfireCPUTemp::init (Gtk::HBox *container)
     throttle2_colour.set_callback (sigc::mem_fun (*this, &WayfireCPUTemp::settings_changed_cb));
     low_temp.set_callback (sigc::mem_fun (*this, &WayfireCPUTemp::settings_changed_cb));
     high_temp.set_callback (sigc::mem_fun (*this, &WayfireCPUTemp::settings_changed_cb));
+    top_threshold.set_callback (sigc::mem_fun (*this, &WayfireCPUTemp::settings_changed_cb));
+    smoothing.set_callback (sigc::mem_fun (*this, &WayfireCPUTemp::settings_changed_cb));
 }
 
 WayfireCPUTemp::~WayfireCPUTemp()
@@ -32,9 +32,107 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PLUGIN_TITLE N_("CPU Temperature")
 
 #define MAX_NUM_SENSORS 10
+#define MAX_NUM_FANS 32                     /* Enough for every fan and pwm on a Super I/O chip */
+#define FAN_PWM_UNKNOWN -2                  /* Fan has a pwm which could not be registered */
+
+#define THROTTLE_HOLD 2                     /* Ticks before a lower throttle colour is shown */
+
+#define PROF_BUCKETS 32
+
+#define TOP_WINDOW 5                        /* Samples over which process usage is measured */
+#define TOP_NUM 5                           /* Number of processes shown in tooltip */
+
+#define REC_INTERVAL 50                     /* Flight recorder sample period in ms */
+#define REC_PRE_SAMPLES 200
+#define REC_POST_SAMPLES 100
+#define REC_SAMPLES (REC_PRE_SAMPLES + REC_POST_SAMPLES)
+#define REC_REARM 3                         /* Degrees back across threshold to re-arm trigger */
+#define REC_MIN_GAP 60                      /* Minimum seconds between recordings */
+#define REC_MAX_FILES 20                    /* Recordings kept in directory */
 
 typedef gint (*GetTempFunc) (char const *);
 
+typedef enum
+{
+    PROF_TICK,
+    PROF_SENSORS,
+    PROF_THROTTLE,
+    PROF_LABEL,
+    PROF_VALIDATE,
+    PROF_GRAPH,
+    PROF_FANS,
+    PROF_NUM_STAGES
+} ProfStage;
+
+typedef enum
+{
+    FAN_RPM,                                /* hwmon fanN_input */
+    FAN_PWM,                                /* hwmon pwmN */
+    FAN_COOLING                             /* thermal cooling_deviceN/cur_state */
+} FanType;
+
+typedef struct
+{
+    FanType type;
+    int fd;                                 /* Persistent handle on value */
+    int max;                                /* Full scale value, 0 if none */
+    int channel;                            /* N in hwmon fanN_input or pwmN */
+    int pwm;                                /* Index of matching pwmN for a fan, -1 if none */
+    gboolean spun;                          /* Fan has been seen spinning */
+    gint value;
+    char *label;
+} FanSensor;
+
+typedef struct
+{
+    guint64 count;
+    guint64 total_ns;
+    guint64 max_ns;
+    guint32 bucket[PROF_BUCKETS];           /* Bucket n holds times in [2^(n-1), 2^n) ns */
+} ProfHist;
+
+typedef struct
+{
+    char *dump_path;                        /* File to dump to, or NULL for the journal */
+    int instance;                           /* Distinguishes plugins in one panel */
+    guint signal;                           /* SIGUSR2 handler source */
+    ProfHist stage[PROF_NUM_STAGES];
+    ProfHist sensor[MAX_NUM_SENSORS];
+} CPUTempProfile;
+
+typedef struct
+{
+    gint64 time;                            /* Monotonic time in us */
+    gint32 mtemp;                           /* Temperature in millidegrees */
+    guint32 throttle;                       /* Last throttle flags seen */
+} RecSample;
+
+typedef struct
+{
+    char *dir;                              /* Directory for recorded windows */
+    int instance;                           /* Distinguishes plugins in one panel */
+    int trigger_temp;                       /* Trigger temperature, 0 to follow upper bound */
+    int fd;                                 /* Persistent handle on sampled sensor */
+    guint timer;                            /* Timer for high rate sampling */
+    guint32 throttle;                       /* Last throttle flags from main update */
+    gboolean have_throttle;
+    RecSample ring[REC_SAMPLES];            /* Circular buffer of recent samples */
+    int head;                               /* Next slot to write in ring */
+    int filled;
+    int post;                               /* Samples left to record after trigger */
+    gint64 trigger_time;                    /* Time of last trigger, 0 if none */
+    gboolean above;                         /* Temperature trigger state */
+    const char *reason;
+    RecSample dump[REC_SAMPLES];            /* Copy of ring being written out */
+    int dump_len;
+    gint64 dump_trigger;
+    const char *dump_reason;
+    GThread *writer;
+    gint busy;                              /* Set while writer thread owns dump */
+} CPUTempRecorder;
+
+typedef struct _CPUTempTop CPUTempTop;    /* Top process sampling state, private */
+
 typedef struct
 {
     GtkWidget *plugin;
@@ -50,16 +148,35 @@ typedef struct
     char *sensor_array[MAX_NUM_SENSORS];
     GetTempFunc get_temperature[MAX_NUM_SENSORS];
     gint temperature[MAX_NUM_SENSORS];
+    int numfans;
+    FanSensor fans[MAX_NUM_FANS];
+    gboolean fan_stalled;                   /* Fan stopped while hot and driven */
+    gboolean shown_stall;                   /* Stall alert shown in label */
+    gint raw[3];                            /* Last raw readings for spike rejection */
+    int nraw;
+    int raw_idx;
+    float filtered;                         /* Smoothed temperature */
+    int shown_temp;                         /* Temperature in label */
+    int shown_thr;                          /* Throttle colour being drawn */
+    int thr_pending;                        /* Lower throttle state waiting to be shown */
+    int thr_hold;                           /* Ticks thr_pending has been seen in a row */
+    char *label;                            /* Cached label text, NULL if not yet drawn */
+    CPUTempProfile *prof;                   /* Update timing histograms, NULL if disabled */
+    CPUTempRecorder *rec;                   /* Throttle flight recorder, NULL if disabled */
+    CPUTempTop *top;                        /* Top process sampling, NULL unless hot */
+    char *tooltip;                          /* Current tooltip text */
     gboolean ispi;
     int lower_temp;                         /* Temperature of bottom of graph */
     int upper_temp;                         /* Temperature of top of graph */
+    int top_threshold;                      /* % of upper_temp at which to list top processes */
+    int smoothing;                          /* % weight of history in filter, 0 for raw */
     GdkRGBA foreground_colour;              /* Foreground colour for drawing area */
     GdkRGBA background_colour;              /* Background colour for drawing area */
     GdkRGBA low_throttle_colour;            /* Colour for bars with ARM freq cap */
     GdkRGBA high_throttle_colour;           /* Colour for bars with throttling */
 } CPUTempPlugin;
 
-extern conf_table_t conf_table[7];
+extern conf_table_t conf_table[9];
 
 /*----------------------------------------------------------------------------*/
 /* Prototypes                                                                 */
@@ -50,6 +50,8 @@ class WayfireCPUTemp : public WayfireWidget
     WfOption <std::string> throttle2_colour {"panel/cputemp_throttle_2"};
     WfOption <int> low_temp {"panel/cputemp_low_temp"};
     WfOption <int> high_temp {"panel/cputemp_high_temp"};
+    WfOption <int> top_threshold {"panel/cputemp_top_threshold"};
+    WfOption <int> smoothing {"panel/cputemp_smoothing"};
 
     /* plugin */
     CPUTempPlugin *cput;